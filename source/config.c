@@ -0,0 +1,242 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+
+#include <wafel/utils.h>
+#include <wafel/services/fsa.h>
+#include <wafel/ios/svc.h>
+
+#include "config.h"
+#include "setup.h"
+#include "verify.h"
+
+#define CONFIG_MAX_SIZE 0x1000
+#define CONFIG_MAX_INSTALL_RETRIES 10
+
+enum {
+    CONFIG_BOOL,
+    CONFIG_U32,
+    CONFIG_STRING,
+};
+
+typedef struct {
+    const char *name;
+    int type;
+    size_t offset;
+    size_t size;
+} config_key_t;
+
+#define CONFIG_KEY(type, field) { #field, type, offsetof(setup_config_t, field), sizeof(((setup_config_t*)0)->field) }
+
+static const config_key_t config_keys[] = {
+    CONFIG_KEY(CONFIG_STRING, install_dir),
+    CONFIG_KEY(CONFIG_BOOL, install),
+    CONFIG_KEY(CONFIG_BOOL, verify),
+    CONFIG_KEY(CONFIG_BOOL, fix_region),
+    CONFIG_KEY(CONFIG_BOOL, initial_launch),
+    CONFIG_KEY(CONFIG_BOOL, delete_plugin),
+    CONFIG_KEY(CONFIG_BOOL, dry_run),
+    CONFIG_KEY(CONFIG_BOOL, verify_read_back),
+    CONFIG_KEY(CONFIG_U32, workers),
+    CONFIG_KEY(CONFIG_U32, buffer_size),
+    CONFIG_KEY(CONFIG_U32, install_retries),
+    CONFIG_KEY(CONFIG_U32, retry_delay_ms),
+    CONFIG_KEY(CONFIG_U32, retry_max_delay_ms),
+    CONFIG_KEY(CONFIG_U32, dry_run_sample_size),
+    CONFIG_KEY(CONFIG_U32, estimate_factor_pct),
+    CONFIG_KEY(CONFIG_U32, estimate_title_overhead_ms),
+};
+
+void config_set_defaults(setup_config_t *config){
+    memset(config, 0, sizeof(*config));
+    strcpy(config->install_dir, "/vol/sdcard/wafel_install");
+    config->install = true;
+    config->verify = true;
+    config->fix_region = true;
+    config->initial_launch = true;
+    config->delete_plugin = true;
+    // reading everything back takes about as long as reading the WUPs, so it's opt-in
+    config->verify_read_back = false;
+    config->workers = 4;
+    config->buffer_size = 0x20000;
+    config->install_retries = 3;
+    config->retry_delay_ms = 500;
+    config->retry_max_delay_ms = 8000;
+    config->dry_run_sample_size = 0x800000;
+    // installing has to decrypt and write to the MLC on top of reading the SD
+    config->estimate_factor_pct = 150;
+    config->estimate_title_overhead_ms = 2000;
+}
+
+static char *trim(char *str){
+    while(*str == ' ' || *str == '\t')
+        str++;
+    char *end = str + strlen(str);
+    while(end > str && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r'))
+        end--;
+    *end = '\0';
+    return str;
+}
+
+static int parse_value(const config_key_t *key, const char *value, setup_config_t *config){
+    void *field = (u8*)config + key->offset;
+    char *end;
+
+    switch(key->type){
+        case CONFIG_BOOL:
+            if(!strcmp(value, "1") || !strcmp(value, "true") || !strcmp(value, "yes"))
+                *(bool*)field = true;
+            else if(!strcmp(value, "0") || !strcmp(value, "false") || !strcmp(value, "no"))
+                *(bool*)field = false;
+            else
+                return -1;
+            return 0;
+        case CONFIG_U32: {
+            // strtoul happily wraps negative numbers
+            if(*value == '-')
+                return -1;
+            u32 num = strtoul(value, &end, 0);
+            if(end == value || *end)
+                return -1;
+            *(u32*)field = num;
+            return 0;
+        }
+        case CONFIG_STRING:
+            if(strlen(value) >= key->size)
+                return -1;
+            strcpy(field, value);
+            return 0;
+    }
+    return -1;
+}
+
+static void parse_line(char *line, int line_nr, int fsaHandle, int logHandle, setup_config_t *config){
+    char *comment = strchr(line, '#');
+    if(comment)
+        *comment = '\0';
+    line = trim(line);
+    if(!*line)
+        return;
+
+    char *value = strchr(line, '=');
+    if(!value){
+        update_error_state(1, 1);
+        log_printf(fsaHandle, logHandle, "Config line %d: missing '='\n", line_nr);
+        return;
+    }
+    *value++ = '\0';
+    line = trim(line);
+    value = trim(value);
+
+    for(int i = 0; i < sizeof(config_keys) / sizeof(config_keys[0]); i++){
+        if(strcmp(line, config_keys[i].name))
+            continue;
+        if(parse_value(&config_keys[i], value, config)){
+            update_error_state(1, 1);
+            log_printf(fsaHandle, logHandle, "Config line %d: invalid value for %s: %s\n", line_nr, line, value);
+        }
+        return;
+    }
+
+    update_error_state(1, 1);
+    log_printf(fsaHandle, logHandle, "Config line %d: unknown key %s\n", line_nr, line);
+}
+
+static int line_count(const char *data){
+    int count = 0;
+    for(; *data; data++){
+        if(*data == '\n')
+            count++;
+    }
+    return count;
+}
+
+int config_load(int fsaHandle, const char *path, int logHandle, setup_config_t *config){
+    int fileHandle = 0;
+    int ret = FSA_OpenFile(fsaHandle, path, "r", &fileHandle);
+    if(ret < 0){
+        debug_printf("No config at %s: %X, using defaults\n", path, ret);
+        log_printf(fsaHandle, logHandle, "No config at %s: %X, using defaults\n", path, ret);
+        return ret;
+    }
+
+    char *data = iosAllocAligned(CROSS_PROCESS_HEAP_ID, CONFIG_MAX_SIZE, 0x40);
+    if(!data){
+        debug_printf("Error allocating config buffer\n");
+        FSA_CloseFile(fsaHandle, fileHandle);
+        return -1;
+    }
+
+    ret = FSA_ReadFile(fsaHandle, data, 1, CONFIG_MAX_SIZE - 1, fileHandle, 0);
+    FSA_CloseFile(fsaHandle, fileHandle);
+    debug_printf("Read config %s: %X\n", path, ret);
+    log_printf(fsaHandle, logHandle, "Read config %s: %X\n", path, ret);
+    if(ret < 0){
+        update_error_state(ret, 1);
+        iosFree(CROSS_PROCESS_HEAP_ID, data);
+        return ret;
+    }
+    data[ret] = '\0';
+
+    if(ret == CONFIG_MAX_SIZE - 1){
+        // the file may go on, don't parse a cut off last line as a valid value
+        char *last = strrchr(data, '\n');
+        if(last)
+            last[1] = '\0';
+        else
+            data[0] = '\0';
+        update_error_state(1, 1);
+        debug_printf("Config %s is too big, only using the first %d bytes\n", path, CONFIG_MAX_SIZE - 1);
+        log_printf(fsaHandle, logHandle, "Config %s is too big, ignoring everything after line %d\n",
+                path, last ? line_count(data) : 0);
+    }
+
+    char *line = data;
+    int line_nr = 1;
+    while(line){
+        char *next = strchr(line, '\n');
+        if(next)
+            *next++ = '\0';
+        parse_line(line, line_nr++, fsaHandle, logHandle, config);
+        line = next;
+    }
+
+    iosFree(CROSS_PROCESS_HEAP_ID, data);
+
+    // FSA wants 0x40 aligned buffers
+    config->buffer_size &= ~0x3FUL;
+    if(config->buffer_size < 0x1000)
+        config->buffer_size = 0x1000;
+    if(!config->workers)
+        config->workers = 1;
+    if(config->workers > VERIFY_MAX_WORKERS)
+        config->workers = VERIFY_MAX_WORKERS;
+    // keep the backoff bounded
+    if(config->install_retries > CONFIG_MAX_INSTALL_RETRIES)
+        config->install_retries = CONFIG_MAX_INSTALL_RETRIES;
+    // usleep takes microseconds in a u32
+    if(config->retry_max_delay_ms > 60000)
+        config->retry_max_delay_ms = 60000;
+    if(config->retry_delay_ms > config->retry_max_delay_ms)
+        config->retry_delay_ms = config->retry_max_delay_ms;
+    return 0;
+}
+
+void config_log(int fsaHandle, int logHandle, const setup_config_t *config){
+    debug_printf("Config: install_dir=%s install=%d verify=%d fix_region=%d initial_launch=%d delete_plugin=%d\n",
+            config->install_dir, config->install, config->verify, config->fix_region,
+            config->initial_launch, config->delete_plugin);
+    log_printf(fsaHandle, logHandle, "Config: install_dir=%s install=%d verify=%d fix_region=%d initial_launch=%d delete_plugin=%d\n",
+            config->install_dir, config->install, config->verify, config->fix_region,
+            config->initial_launch, config->delete_plugin);
+    log_printf(fsaHandle, logHandle, "Config: verify_read_back=%d workers=%lu buffer_size=0x%lX\n",
+            config->verify_read_back, config->workers, config->buffer_size);
+    log_printf(fsaHandle, logHandle, "Config: install_retries=%lu retry_delay_ms=%lu retry_max_delay_ms=%lu\n",
+            config->install_retries, config->retry_delay_ms, config->retry_max_delay_ms);
+    if(config->dry_run){
+        debug_printf("Config: dry run\n");
+        log_printf(fsaHandle, logHandle, "Config: dry_run=1 dry_run_sample_size=0x%lX estimate_factor_pct=%lu estimate_title_overhead_ms=%lu\n",
+                config->dry_run_sample_size, config->estimate_factor_pct, config->estimate_title_overhead_ms);
+    }
+}
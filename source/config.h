@@ -0,0 +1,39 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <wafel/types.h>
+
+#define CONFIG_PATH "/vol/sdcard/wafel_setup_mlc.cfg"
+#define CONFIG_PATH_SIZE 0x100
+
+typedef struct {
+    char install_dir[CONFIG_PATH_SIZE];
+    // phases
+    bool install;
+    bool verify;
+    bool fix_region;
+    bool initial_launch;
+    bool delete_plugin;
+    // only check the titles and estimate the install time, nothing gets written
+    bool dry_run;
+    // tuning
+    bool verify_read_back;
+    u32 workers;
+    u32 buffer_size;
+    u32 install_retries;
+    u32 retry_delay_ms;
+    u32 retry_max_delay_ms;
+    // dry run calibration
+    u32 dry_run_sample_size;
+    u32 estimate_factor_pct;
+    u32 estimate_title_overhead_ms;
+} setup_config_t;
+
+void config_set_defaults(setup_config_t *config);
+
+// Overrides the defaults with what's set in path, a missing file keeps the defaults
+int config_load(int fsaHandle, const char *path, int logHandle, setup_config_t *config);
+
+void config_log(int fsaHandle, int logHandle, const setup_config_t *config);
+
+#endif
@@ -0,0 +1,55 @@
+#include <wafel/services/fsa.h>
+
+#include "fileio.h"
+
+#define FSA_END_OF_FILE_ERROR (-0x30005)
+
+
+int read_file(int fsaHandle, const char *path, void *buffer, u32 size, u32 *out_size){
+    int fileHandle = 0;
+    int ret = FSA_OpenFile(fsaHandle, path, "r", &fileHandle);
+    if(ret < 0)
+        return ret;
+
+    u32 total = 0;
+    while(total < size){
+        ret = FSA_ReadFile(fsaHandle, (u8*)buffer + total, 1, size - total, fileHandle, 0);
+        if(ret <= 0)
+            break;
+        total += ret;
+    }
+    FSA_CloseFile(fsaHandle, fileHandle);
+
+    *out_size = total;
+    if(ret < 0 && ret != FSA_END_OF_FILE_ERROR)
+        return ret;
+    return 0;
+}
+
+int read_file_sequential(int fsaHandle, const char *path, void *buffer, u32 buffer_size, u32 max_bytes, u64 *bytes_read){
+    int fileHandle = 0;
+    int ret = FSA_OpenFile(fsaHandle, path, "r", &fileHandle);
+    if(ret < 0)
+        return ret;
+
+    u64 total = 0;
+    while(!max_bytes || total < max_bytes){
+        u32 chunk = buffer_size;
+        if(max_bytes && max_bytes - total < chunk)
+            chunk = max_bytes - total;
+
+        ret = FSA_ReadFile(fsaHandle, buffer, 1, chunk, fileHandle, 0);
+        if(ret <= 0)
+            break;
+        total += ret;
+        if((u32)ret < chunk)
+            break; // short read means we hit the end of the file
+    }
+    FSA_CloseFile(fsaHandle, fileHandle);
+
+    if(bytes_read)
+        *bytes_read = total;
+    if(ret < 0 && ret != FSA_END_OF_FILE_ERROR)
+        return ret;
+    return 0;
+}
@@ -0,0 +1,12 @@
+#ifndef FILEIO_H
+#define FILEIO_H
+
+#include <wafel/types.h>
+
+// Reads up to size bytes of a file into buffer, out_size is how much was read
+int read_file(int fsaHandle, const char *path, void *buffer, u32 size, u32 *out_size);
+
+// Reads a file front to back in buffer_size chunks, stops after max_bytes (0 = whole file)
+int read_file_sequential(int fsaHandle, const char *path, void *buffer, u32 buffer_size, u32 max_bytes, u64 *bytes_read);
+
+#endif
@@ -0,0 +1,186 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <wafel/utils.h>
+#include <wafel/services/fsa.h>
+#include <wafel/ios/svc.h>
+
+#include "plan.h"
+#include "setup.h"
+#include "fileio.h"
+#include "timer.h"
+
+#define PLAN_PATH_SIZE 0x280
+#define PLAN_NAME_SIZE 0x100
+#define PLAN_TITLES_STEP 16
+
+typedef struct {
+    char name[PLAN_NAME_SIZE];
+    int info;
+    u32 files;
+    u64 bytes;
+    char largest[PLAN_NAME_SIZE];
+    u32 largest_size;
+    u64 sample_bytes;
+    u32 sample_ms;
+} plan_title_t;
+
+
+// Sums up the WUP and remembers its largest file, which is what gets sampled
+static int scan_title(int fsaHandle, const char *path, directoryEntry_s *dir_entry, plan_title_t *title){
+    int dir = 0;
+    int ret = FSA_OpenDir(fsaHandle, path, &dir);
+    if(ret < 0)
+        return ret;
+
+    while(!FSA_ReadDir(fsaHandle, dir, dir_entry)){
+        if(dir_entry->stat.flags & 0x80000000)
+            continue;
+        title->files++;
+        title->bytes += dir_entry->stat.size;
+        if(dir_entry->stat.size > title->largest_size){
+            title->largest_size = dir_entry->stat.size;
+            snprintf(title->largest, PLAN_NAME_SIZE, "%s", dir_entry->name);
+        }
+    }
+    FSA_CloseDir(fsaHandle, dir);
+    return 0;
+}
+
+static u32 estimate_ms(const plan_title_t *title, u32 kbs, const setup_config_t *config){
+    u64 ms = config->estimate_title_overhead_ms;
+    if(kbs)
+        ms += title->bytes * 1000 / 1024 / kbs * config->estimate_factor_pct / 100;
+    return (u32)ms;
+}
+
+int plan_install(int fsaHandle, int logHandle, const setup_config_t *config){
+    const char *directory = config->install_dir;
+    int dir = 0;
+    int ret = FSA_OpenDir(fsaHandle, directory, &dir);
+    log_printf(fsaHandle, logHandle, "Plan: OpenDir %s: %X\n", directory, ret);
+    if(ret < 0){
+        update_error_state(1, 2);
+        debug_printf("Dir %s open failed: %X Aborting...\n", directory, ret);
+        return ret;
+    }
+
+    int mcp_handle = iosOpen("/dev/mcp", 0);
+    if(mcp_handle <= 0){
+        update_error_state(1, 2);
+        debug_printf("Failed to open MCP : -%08X\n", mcp_handle);
+        log_printf(fsaHandle, logHandle, "Plan: failed to open MCP: %X\n", mcp_handle);
+        FSA_CloseDir(fsaHandle, dir);
+        return -1;
+    }
+
+    directoryEntry_s *dir_entry = iosAlloc(0x00001, sizeof(directoryEntry_s));
+    char *path = iosAlloc(0x00001, PLAN_PATH_SIZE);
+    void *buffer = iosAllocAligned(CROSS_PROCESS_HEAP_ID, config->buffer_size, 0x40);
+    if(!dir_entry || !path || !buffer){
+        update_error_state(1, 2);
+        debug_printf("Plan: alloc failed, Aborting...\n");
+        if(buffer) iosFree(CROSS_PROCESS_HEAP_ID, buffer);
+        if(path) iosFree(0x00001, path);
+        if(dir_entry) iosFree(0x00001, dir_entry);
+        iosClose(mcp_handle);
+        FSA_CloseDir(fsaHandle, dir);
+        return -1;
+    }
+
+    // Check and sample every title first, the estimates need the overall SD speed
+    int count = 0, capacity = 0, installable = 0;
+    u64 total_bytes = 0, sample_bytes = 0;
+    u32 sample_ms = 0;
+    plan_title_t *titles = NULL;
+
+    while(!FSA_ReadDir(fsaHandle, dir, dir_entry)){
+        if(!(dir_entry->stat.flags & 0x80000000))
+            continue;
+
+        if(count == capacity){
+            plan_title_t *grown = iosAlloc(0x00001, (capacity + PLAN_TITLES_STEP) * sizeof(plan_title_t));
+            if(!grown){
+                update_error_state(1, 2);
+                debug_printf("Plan: alloc failed for %s\n", dir_entry->name);
+                break;
+            }
+            if(titles){
+                memcpy(grown, titles, count * sizeof(plan_title_t));
+                iosFree(0x00001, titles);
+            }
+            titles = grown;
+            capacity += PLAN_TITLES_STEP;
+        }
+        plan_title_t *title = &titles[count++];
+        memset(title, 0, sizeof(*title));
+        snprintf(title->name, PLAN_NAME_SIZE, "%s", dir_entry->name);
+
+        snprintf(path, PLAN_PATH_SIZE, "%s/%s", directory, title->name);
+        title->info = MCP_InstallGetInfo(mcp_handle, path);
+        debug_printf("installinfo %s: %08x\n", title->name, title->info);
+        update_error_state(title->info, 1);
+        if(title->info)
+            continue;
+        installable++;
+
+        ret = scan_title(fsaHandle, path, dir_entry, title);
+        if(ret < 0 || !title->largest_size){
+            update_error_state(1, 1);
+            log_printf(fsaHandle, logHandle, "Plan %s: scan failed: %X\n", title->name, ret);
+            continue;
+        }
+        total_bytes += title->bytes;
+
+        snprintf(path, PLAN_PATH_SIZE, "%s/%s/%s", directory, title->name, title->largest);
+        u32 start = timer_ticks();
+        ret = read_file_sequential(fsaHandle, path, buffer, config->buffer_size, config->dry_run_sample_size, &title->sample_bytes);
+        title->sample_ms = timer_elapsed_ms(start);
+        if(ret < 0){
+            update_error_state(ret, 1);
+            log_printf(fsaHandle, logHandle, "Plan %s: read %s failed: %X\n", title->name, title->largest, ret);
+            continue;
+        }
+        sample_bytes += title->sample_bytes;
+        sample_ms += title->sample_ms;
+    }
+
+    u32 kbs = throughput_kbs(sample_bytes, sample_ms);
+    debug_printf("Plan: SD read %llu bytes in %lu ms, %lu.%02lu MB/s\n",
+            sample_bytes, sample_ms, kbs / 1024, (kbs % 1024) * 100 / 1024);
+    log_printf(fsaHandle, logHandle, "Plan: SD read %llu bytes in %lu ms, %lu.%02lu MB/s\n",
+            sample_bytes, sample_ms, kbs / 1024, (kbs % 1024) * 100 / 1024);
+    if(!kbs){
+        update_error_state(1, 1);
+        log_printf(fsaHandle, logHandle, "Plan: no SD throughput measured, estimates only include overhead\n");
+    }
+
+    u64 total_ms = 0;
+    for(int i = 0; i < count; i++){
+        plan_title_t *t = &titles[i];
+        if(t->info){
+            log_printf(fsaHandle, logHandle, "Plan %s: not installable: %08x\n", t->name, t->info);
+            continue;
+        }
+        u32 title_kbs = throughput_kbs(t->sample_bytes, t->sample_ms);
+        u32 ms = estimate_ms(t, kbs, config);
+        total_ms += ms;
+        log_printf(fsaHandle, logHandle, "Plan %s: %lu files, %llu bytes, sample %lu.%02lu MB/s, estimate %lu s\n",
+                t->name, t->files, t->bytes, title_kbs / 1024, (title_kbs % 1024) * 100 / 1024, ms / 1000);
+    }
+
+    debug_printf("Plan: %d/%d titles installable, %llu bytes, estimate %llu s\n",
+            installable, count, total_bytes, total_ms / 1000);
+    log_printf(fsaHandle, logHandle, "Plan: %d/%d titles installable, %llu bytes, estimate %llu min %llu s\n",
+            installable, count, total_bytes, total_ms / 60000, (total_ms / 1000) % 60);
+    ret = count - installable;
+
+    if(titles)
+        iosFree(0x00001, titles);
+    iosFree(CROSS_PROCESS_HEAP_ID, buffer);
+    iosFree(0x00001, path);
+    iosFree(0x00001, dir_entry);
+    iosClose(mcp_handle);
+    FSA_CloseDir(fsaHandle, dir);
+    return ret;
+}
@@ -0,0 +1,12 @@
+#ifndef PLAN_H
+#define PLAN_H
+
+#include <wafel/types.h>
+
+#include "config.h"
+
+// Dry run: checks every title in the install dir and estimates how long installing them takes.
+// Only reads from the SD, nothing gets written to MLC or SLC.
+int plan_install(int fsaHandle, int logHandle, const setup_config_t *config);
+
+#endif
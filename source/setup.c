@@ -11,12 +11,14 @@
 #include "sci.h"
 #include "led.h"
 #include "sysprod.h"
+#include "verify.h"
+#include "config.h"
+#include "plan.h"
 
 #define MAX_LOG_LINE_LENGHT 512
-#define CROSS_PROCESS_HEAP_ID 0xcaff
 
 
-static int log_printf(int fsaHandle, int logHandle, const char* fmt, ...){
+int log_printf(int fsaHandle, int logHandle, const char* fmt, ...){
     if(!logHandle) {
         return -1;
     }
@@ -101,6 +103,56 @@ int install_title(int mcp_handle, char *install_dir){
         return ret;
 }
 
+// IOS and FSA errors that are worth retrying, everything else is treated as permanent.
+// MCP_Install's own errors (0xFFFBxxxx) aren't documented well enough to tell a busy
+// MCP from a real failure, so they're all permanent and only get the retry at the end.
+// IOS/FSA errors MCP passes through from the SD are still caught here.
+static bool is_transient_error(int err){
+    switch(err){
+        case -5:        // IOS max handles
+        case -8:        // IOS queue full
+        case -10:       // IOS not ready
+        case -0x30002:  // FSA busy
+        case -0x30012:  // FSA max clients
+        case -0x30013:  // FSA max files
+        case -0x30014:  // FSA max dirs
+        case -0x3002C:  // FSA out of resources
+        case -0x30040:  // FSA media not ready
+        case -0x30041:  // FSA media error
+            return true;
+        default:
+            return false;
+    }
+}
+
+typedef struct {
+    u32 installed;
+    u32 recovered;
+    u32 failed;
+    u32 not_installable;
+    u32 retries;
+} install_stats_t;
+
+// Retries transient errors with exponential backoff, permanent errors return right away
+static int install_title_retry(int fd, int logHandle, int mcp_handle, char *install_dir, const char *name,
+        const setup_config_t *config, install_stats_t *stats){
+    u32 delay_ms = config->retry_delay_ms;
+    int ret = install_title(mcp_handle, install_dir);
+    for(u32 attempt = 1; ret && is_transient_error(ret) && attempt <= config->install_retries; attempt++){
+        debug_printf("Install %s: transient error %08x, retry %lu/%lu in %lu ms\n",
+                name, ret, attempt, config->install_retries, delay_ms);
+        log_printf(fd, logHandle, "Install %s: transient error %08x, retry %lu/%lu in %lu ms\n",
+                name, ret, attempt, config->install_retries, delay_ms);
+        usleep(delay_ms * 1000);
+        delay_ms *= 2;
+        if(delay_ms > config->retry_max_delay_ms)
+            delay_ms = config->retry_max_delay_ms;
+        stats->retries++;
+        ret = install_title(mcp_handle, install_dir);
+    }
+    return ret;
+}
+
 int error_state = 0;
 
 void update_error_state(int value, int level){
@@ -119,7 +171,8 @@ void update_error_state(int value, int level){
 }
 
 
-void install_all_titles(int fd, char *directory, int logHandle){
+void install_all_titles(int fd, const setup_config_t *config, int logHandle){
+    const char *directory = config->install_dir;
     int dir = 0;
     int ret = FSA_OpenDir(fd, directory, &dir);
     log_printf(fd,logHandle, "OpenDir %s: %X\n", directory, ret);
@@ -162,6 +215,11 @@ void install_all_titles(int fd, char *directory, int logHandle){
         return;
     }
 
+    install_stats_t stats = { 0 };
+    // titles that still failed after their retries get one more go at the end
+    char (*retry_queue)[0x100] = NULL;
+    int queued = 0, queue_capacity = 0;
+
     while(!FSA_ReadDir(fd, dir, dir_entry))
     {
         if(dir_entry->stat.flags & 0x80000000)
@@ -174,13 +232,62 @@ void install_all_titles(int fd, char *directory, int logHandle){
             debug_printf("installinfo %s: %08x\n", dir_entry->name, ret);
             update_error_state(ret, 1);
             log_printf(fd,logHandle, "InstallInfo %s: %08x\n", dir_entry->name, ret);
-            if(!ret){
-                ret = install_title(mcp_handle, install_dir);
-                update_error_state(ret, 2);
+            if(ret){
+                stats.not_installable++;
+            }else{
+                u32 retries = stats.retries;
+                ret = install_title_retry(fd, logHandle, mcp_handle, install_dir, dir_entry->name, config, &stats);
                 log_printf(fd, logHandle, "Install %s: %08x\n", dir_entry->name, ret);
+                if(!ret){
+                    stats.installed++;
+                    if(stats.retries != retries)
+                        stats.recovered++;
+                    continue;
+                }
+
+                if(queued == queue_capacity){
+                    char (*grown)[0x100] = iosAlloc(0x00001, (queue_capacity + 8) * 0x100);
+                    if(!grown){
+                        debug_printf("Failed to grow retry queue, not retrying %s\n", dir_entry->name);
+                        update_error_state(ret, 2);
+                        stats.failed++;
+                        continue;
+                    }
+                    if(retry_queue){
+                        memcpy(grown, retry_queue, queued * 0x100);
+                        iosFree(0x00001, retry_queue);
+                    }
+                    retry_queue = grown;
+                    queue_capacity += 8;
+                }
+                log_printf(fd, logHandle, "Install %s: %s error, retrying at the end\n",
+                        dir_entry->name, is_transient_error(ret) ? "transient" : "permanent");
+                snprintf(retry_queue[queued++], 0x100, "%s", dir_entry->name);
             }
         }
     }
+
+    for(int i = 0; i < queued; i++){
+        snprintf(install_dir, 0x100, "%s/%s", directory, retry_queue[i]);
+        stats.retries++;
+        ret = install_title_retry(fd, logHandle, mcp_handle, install_dir, retry_queue[i], config, &stats);
+        update_error_state(ret, 2);
+        log_printf(fd, logHandle, "Install %s (end retry): %08x\n", retry_queue[i], ret);
+        if(!ret){
+            stats.installed++;
+            stats.recovered++;
+        }else{
+            stats.failed++;
+        }
+    }
+
+    debug_printf("Install summary: %lu installed, %lu recovered by retry, %lu failed, %lu not installable, %lu retries\n",
+            stats.installed, stats.recovered, stats.failed, stats.not_installable, stats.retries);
+    log_printf(fd, logHandle, "Install summary: %lu installed, %lu recovered by retry, %lu failed, %lu not installable, %lu retries\n",
+            stats.installed, stats.recovered, stats.failed, stats.not_installable, stats.retries);
+
+    if(retry_queue)
+        iosFree(0x00001, retry_queue);
     iosFree(0x00001, install_dir);
     iosFree(0x00001, dir_entry);
     iosClose(mcp_handle);
@@ -285,24 +392,62 @@ u32 setup_main(void* arg){
     debug_printf("Open logfile -%X\n", -ret);
     update_error_state(ret, 1);
 
-    install_all_titles(fsaHandle, "/vol/sdcard/wafel_install", logHandle);
-    int flush_ret = flush_mlc(fsaHandle);
-    update_error_state(flush_ret, 2);
-    log_printf(fsaHandle, logHandle, "Flush MLC: %X\n", flush_ret);
+    // static, the setup thread only has a 0x1000 stack
+    static setup_config_t config;
+    config_set_defaults(&config);
+    config_load(fsaHandle, CONFIG_PATH, logHandle, &config);
+    if(config.dry_run){
+        // nothing may touch MLC, SLC or usr_cfg and the plugin has to stay for the real run
+        config.install = false;
+        config.verify = false;
+        config.fix_region = false;
+        config.initial_launch = false;
+        config.delete_plugin = false;
+    }
+    config_log(fsaHandle, logHandle, &config);
 
-    fix_region(fsaHandle, logHandle);
+    if(config.dry_run){
+        ret = plan_install(fsaHandle, logHandle, &config);
+        debug_printf("Plan returned %d\n", ret);
+    }
 
-    ret = SCISetInitialLaunch(0);
-    debug_printf("Set InitalLaunch returned %X\n", ret);
-    update_error_state(ret<0, 2);
-    log_printf(fsaHandle, logHandle, "SetInitialLaunch 0: %X\n", ret);
-    ret = flush_slc(fsaHandle);
-    update_error_state(ret, 2);
-    log_printf(fsaHandle, logHandle, "Flush SLC: %X\n", ret);
+    if(config.install){
+        install_all_titles(fsaHandle, &config, logHandle);
+        int flush_ret = flush_mlc(fsaHandle);
+        update_error_state(flush_ret, 2);
+        log_printf(fsaHandle, logHandle, "Flush MLC: %X\n", flush_ret);
+    }
+
+    if(config.verify){
+        ret = verify_all_titles(fsaHandle, config.install_dir, logHandle, config.verify_read_back, config.workers, config.buffer_size);
+        debug_printf("Verify returned %d\n", ret);
+        if(ret < 0)
+            update_error_state(ret, 1);
+        else
+            update_error_state(ret, 2);
+    }
 
-    ret = FSA_Remove(fsaHandle, "/vol/sdcard/wiiu/ios_plugins/wafel_setup_mlc.ipx");
-    debug_printf("Delete plugin: %X\n", ret);
-    log_printf(fsaHandle, logHandle, "Delete plugin: %X\n", ret);
+    if(config.fix_region)
+        fix_region(fsaHandle, logHandle);
+
+    if(config.initial_launch){
+        ret = SCISetInitialLaunch(0);
+        debug_printf("Set InitalLaunch returned %X\n", ret);
+        update_error_state(ret<0, 2);
+        log_printf(fsaHandle, logHandle, "SetInitialLaunch 0: %X\n", ret);
+    }
+
+    if(config.fix_region || config.initial_launch){
+        ret = flush_slc(fsaHandle);
+        update_error_state(ret, 2);
+        log_printf(fsaHandle, logHandle, "Flush SLC: %X\n", ret);
+    }
+
+    if(config.delete_plugin){
+        ret = FSA_Remove(fsaHandle, "/vol/sdcard/wiiu/ios_plugins/wafel_setup_mlc.ipx");
+        debug_printf("Delete plugin: %X\n", ret);
+        log_printf(fsaHandle, logHandle, "Delete plugin: %X\n", ret);
+    }
 
 
     ret = FSA_CloseFile(fsaHandle, logHandle);
@@ -3,6 +3,11 @@
 
 #include <wafel/types.h>
 
+#define CROSS_PROCESS_HEAP_ID 0xcaff
+
+int log_printf(int fsaHandle, int logHandle, const char* fmt, ...);
+void update_error_state(int value, int level);
+
 u32 setup_main(void* arg);
 
 #endif
\ No newline at end of file
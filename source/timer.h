@@ -0,0 +1,29 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <wafel/types.h>
+
+// Latte free running timer, ticks at roughly 1.9MHz (same rate minute's udelay assumes).
+// It is 32bit, so it wraps after ~37 minutes; only use it to time shorter phases.
+#define LT_TIMER 0x0d800010
+
+static inline u32 timer_ticks(void){
+    return *(vu32*)LT_TIMER;
+}
+
+static inline u32 timer_ticks_to_ms(u32 ticks){
+    return ticks / 1898;
+}
+
+static inline u32 timer_elapsed_ms(u32 start_ticks){
+    return timer_ticks_to_ms(timer_ticks() - start_ticks);
+}
+
+// KiB/s for bytes transferred in ms, 0 if nothing was measured
+static inline u32 throughput_kbs(u64 bytes, u32 ms){
+    if(!ms)
+        return 0;
+    return (u32)((bytes * 1000) / ms / 1024);
+}
+
+#endif
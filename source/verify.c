@@ -0,0 +1,483 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <wafel/utils.h>
+#include <wafel/services/fsa.h>
+#include <wafel/ios/thread.h>
+#include <wafel/ios/svc.h>
+
+#include "verify.h"
+#include "setup.h"
+#include "timer.h"
+#include "fileio.h"
+
+#define TMD_TITLE_ID_OFFSET 0x18C
+#define TMD_CONTENT_COUNT_OFFSET 0x1DE
+#define TMD_CONTENT_RECORDS_OFFSET 0xB04
+#define TMD_CONTENT_RECORD_SIZE 0x30
+#define TMD_HEADER_SIZE 0x200
+#define TMD_MAX_SIZE 0x4000
+
+#define VERIFY_PATH_SIZE 0x280
+#define VERIFY_NAME_SIZE 0x100
+// Every worker runs on its own thread, the setup thread only has 0x1000 of stack.
+// read_tree recurses once per directory level with small frames (paths and dir
+// entries live on the heap), titles are only a few levels deep.
+#define VERIFY_STACK_SIZE 0x2000
+
+enum {
+    VERIFY_OK = 0,
+    // titles that were never installed or couldn't be checked, only a warning
+    VERIFY_NOT_INSTALLABLE,
+    VERIFY_NO_SOURCE_TMD,
+    VERIFY_NOT_CHECKED,
+    // installed titles that failed verification
+    VERIFY_MISSING_DIR,
+    VERIFY_MISSING_TMD,
+    VERIFY_TMD_MISMATCH,
+    VERIFY_READ_ERROR,
+    VERIFY_SIZE_MISMATCH,
+};
+
+static const char *verify_result_names[] = {
+    "OK",
+    "not installable",
+    "no source TMD",
+    "not checked",
+    "missing directory",
+    "missing TMD",
+    "TMD mismatch",
+    "read error",
+    "size mismatch",
+};
+
+typedef struct {
+    char name[VERIFY_NAME_SIZE];
+    u64 title_id;
+    u32 tmd_size;
+    int result;
+    int error;
+    u32 files;
+    u64 bytes;
+    u32 ms;
+} verify_title_t;
+
+typedef struct {
+    const char *directory;
+    verify_title_t *titles;
+    int count;
+    int first;
+    int stride;
+    bool read_back;
+    int fsaHandle;
+    void *buffer;
+    u32 buffer_size;
+    u8 *tmd_sd;
+    u8 *tmd_mlc;
+    char *path;
+    u8 *stack;
+    int threadhand;
+} verify_worker_t;
+
+
+int read_tmd_info(int fsaHandle, const char *path, u64 *title_id, u32 *tmd_size){
+    u8 *header = iosAllocAligned(CROSS_PROCESS_HEAP_ID, TMD_HEADER_SIZE, 0x40);
+    if(!header)
+        return -1;
+
+    u32 size = 0;
+    int ret = read_file(fsaHandle, path, header, TMD_HEADER_SIZE, &size);
+    if(!ret && size < TMD_CONTENT_COUNT_OFFSET + sizeof(u16))
+        ret = -1;
+
+    if(!ret){
+        u16 content_count;
+        memcpy(title_id, header + TMD_TITLE_ID_OFFSET, sizeof(*title_id));
+        memcpy(&content_count, header + TMD_CONTENT_COUNT_OFFSET, sizeof(content_count));
+        // only the signed part, NUS TMDs have the cert chain appended
+        *tmd_size = TMD_CONTENT_RECORDS_OFFSET + content_count * TMD_CONTENT_RECORD_SIZE;
+    }
+
+    iosFree(CROSS_PROCESS_HEAP_ID, header);
+    return ret;
+}
+
+static const char *title_location(u64 title_id){
+    switch((u32)(title_id >> 32)){
+        case 0x00050010:
+        case 0x0005001B:
+        case 0x00050030:
+            return "sys";
+        default:
+            return "usr";
+    }
+}
+
+static int dir_exists(int fsaHandle, const char *path){
+    int dir = 0;
+    int ret = FSA_OpenDir(fsaHandle, path, &dir);
+    if(ret < 0)
+        return ret;
+    FSA_CloseDir(fsaHandle, dir);
+    return 0;
+}
+
+static void set_result(verify_title_t *title, int result, int error){
+    if(title->result == VERIFY_OK){
+        title->result = result;
+        title->error = error;
+    }
+}
+
+// Reads every file below worker->path, path is restored before returning
+static void read_tree(verify_worker_t *worker, verify_title_t *title){
+    int dir = 0;
+    int ret = FSA_OpenDir(worker->fsaHandle, worker->path, &dir);
+    if(ret < 0){
+        set_result(title, VERIFY_READ_ERROR, ret);
+        return;
+    }
+
+    directoryEntry_s *dir_entry = iosAlloc(0x00001, sizeof(directoryEntry_s));
+    if(!dir_entry){
+        set_result(title, VERIFY_READ_ERROR, -1);
+        FSA_CloseDir(worker->fsaHandle, dir);
+        return;
+    }
+
+    u32 path_len = strlen(worker->path);
+    while(!FSA_ReadDir(worker->fsaHandle, dir, dir_entry)){
+        snprintf(worker->path + path_len, VERIFY_PATH_SIZE - path_len, "/%s", dir_entry->name);
+        if(dir_entry->stat.flags & 0x80000000){
+            read_tree(worker, title);
+        } else {
+            u64 bytes = 0;
+            ret = read_file_sequential(worker->fsaHandle, worker->path, worker->buffer, worker->buffer_size, 0, &bytes);
+            title->files++;
+            title->bytes += bytes;
+            if(ret < 0){
+                debug_printf("Verify read %s failed: %X\n", worker->path, ret);
+                set_result(title, VERIFY_READ_ERROR, ret);
+            } else if(bytes != dir_entry->stat.size){
+                debug_printf("Verify %s: read %llu of %lu bytes\n", worker->path, bytes, dir_entry->stat.size);
+                set_result(title, VERIFY_SIZE_MISMATCH, 0);
+            }
+        }
+        worker->path[path_len] = '\0';
+    }
+
+    iosFree(0x00001, dir_entry);
+    FSA_CloseDir(worker->fsaHandle, dir);
+}
+
+static void verify_title(verify_worker_t *worker, verify_title_t *title){
+    static const char *required_dirs[] = { "", "/code", "/meta" };
+    u32 start = timer_ticks();
+    u32 size = 0;
+
+    snprintf(worker->path, VERIFY_PATH_SIZE, "%s/%s/title.tmd", worker->directory, title->name);
+    int ret = read_file(worker->fsaHandle, worker->path, worker->tmd_sd, title->tmd_size, &size);
+    if(ret < 0 || size != title->tmd_size){
+        set_result(title, VERIFY_NO_SOURCE_TMD, ret);
+        return;
+    }
+
+    int title_path_len = snprintf(worker->path, VERIFY_PATH_SIZE, "/vol/storage_mlc01/%s/title/%08lx/%08lx",
+            title_location(title->title_id), (uint32_t)(title->title_id >> 32), (uint32_t)(title->title_id & 0xFFFFFFFFU));
+
+    for(int i = 0; i < sizeof(required_dirs) / sizeof(required_dirs[0]); i++){
+        strcpy(worker->path + title_path_len, required_dirs[i]);
+        ret = dir_exists(worker->fsaHandle, worker->path);
+        if(ret < 0){
+            debug_printf("Verify: %s missing: %X\n", worker->path, ret);
+            set_result(title, VERIFY_MISSING_DIR, ret);
+            return;
+        }
+    }
+
+    strcpy(worker->path + title_path_len, "/code/title.tmd");
+    ret = read_file(worker->fsaHandle, worker->path, worker->tmd_mlc, title->tmd_size, &size);
+    if(ret < 0 || size != title->tmd_size)
+        set_result(title, VERIFY_MISSING_TMD, ret);
+    else if(memcmp(worker->tmd_sd, worker->tmd_mlc, title->tmd_size))
+        set_result(title, VERIFY_TMD_MISMATCH, 0);
+
+    if(worker->read_back){
+        worker->path[title_path_len] = '\0';
+        read_tree(worker, title);
+    }
+
+    title->ms = timer_elapsed_ms(start);
+}
+
+static u32 verify_worker(void *arg){
+    verify_worker_t *worker = arg;
+    for(int i = worker->first; i < worker->count; i += worker->stride){
+        verify_title_t *title = &worker->titles[i];
+        if(title->result == VERIFY_OK)
+            verify_title(worker, title);
+        debug_printf("Verify %s: %s\n", title->name, verify_result_names[title->result]);
+    }
+    return 0;
+}
+
+static void free_worker(verify_worker_t *worker, int fsaHandle){
+    if(worker->fsaHandle >= 0 && worker->fsaHandle != fsaHandle)
+        iosClose(worker->fsaHandle);
+    if(worker->buffer)
+        iosFree(CROSS_PROCESS_HEAP_ID, worker->buffer);
+    if(worker->tmd_sd)
+        iosFree(CROSS_PROCESS_HEAP_ID, worker->tmd_sd);
+    if(worker->tmd_mlc)
+        iosFree(CROSS_PROCESS_HEAP_ID, worker->tmd_mlc);
+    if(worker->path)
+        iosFree(0x00001, worker->path);
+    if(worker->stack)
+        iosFree(0x00001, worker->stack);
+}
+
+static bool alloc_worker(verify_worker_t *worker, int fsaHandle, u32 buffer_size){
+    // separate FSA clients so the reads don't serialize on one handle
+    worker->fsaHandle = FSA_Open();
+    if(worker->fsaHandle < 0)
+        worker->fsaHandle = fsaHandle;
+
+    worker->buffer_size = buffer_size;
+    worker->buffer = iosAllocAligned(CROSS_PROCESS_HEAP_ID, buffer_size, 0x40);
+    worker->tmd_sd = iosAllocAligned(CROSS_PROCESS_HEAP_ID, TMD_MAX_SIZE, 0x40);
+    worker->tmd_mlc = iosAllocAligned(CROSS_PROCESS_HEAP_ID, TMD_MAX_SIZE, 0x40);
+    worker->path = iosAlloc(0x00001, VERIFY_PATH_SIZE);
+    if(!worker->buffer || !worker->tmd_sd || !worker->tmd_mlc || !worker->path){
+        free_worker(worker, fsaHandle);
+        memset(worker, 0, sizeof(*worker));
+        return false;
+    }
+    return true;
+}
+
+static int count_title_dirs(int fsaHandle, const char *directory, directoryEntry_s *dir_entry){
+    int dir = 0;
+    int ret = FSA_OpenDir(fsaHandle, directory, &dir);
+    if(ret < 0)
+        return ret;
+
+    int count = 0;
+    while(!FSA_ReadDir(fsaHandle, dir, dir_entry)){
+        if(dir_entry->stat.flags & 0x80000000)
+            count++;
+    }
+    FSA_CloseDir(fsaHandle, dir);
+    return count;
+}
+
+static int load_manifest(int fsaHandle, const char *directory, int logHandle, verify_title_t **out_titles){
+    directoryEntry_s *dir_entry = iosAlloc(0x00001, sizeof(directoryEntry_s));
+    char *path = iosAlloc(0x00001, VERIFY_PATH_SIZE);
+    if(!dir_entry || !path){
+        debug_printf("Verify: manifest alloc failed\n");
+        if(dir_entry) iosFree(0x00001, dir_entry);
+        if(path) iosFree(0x00001, path);
+        return -1;
+    }
+
+    int count = count_title_dirs(fsaHandle, directory, dir_entry);
+    verify_title_t *titles = NULL;
+    if(count > 0){
+        titles = iosAlloc(0x00001, count * sizeof(verify_title_t));
+        if(!titles)
+            count = -1;
+    }
+
+    int dir = 0;
+    if(count > 0 && FSA_OpenDir(fsaHandle, directory, &dir) < 0)
+        count = -1;
+
+    // titles MCP rejects were skipped by the install, so there's nothing to verify
+    int mcp_handle = iosOpen("/dev/mcp", 0);
+    if(mcp_handle <= 0){
+        debug_printf("Verify: failed to open MCP: %X\n", mcp_handle);
+        log_printf(fsaHandle, logHandle, "Verify: failed to open MCP: %X, checking all titles\n", mcp_handle);
+    }
+
+    if(count > 0){
+        memset(titles, 0, count * sizeof(verify_title_t));
+        int i = 0;
+        // the directory shouldn't change between passes, but don't trust it
+        while(i < count && !FSA_ReadDir(fsaHandle, dir, dir_entry)){
+            if(!(dir_entry->stat.flags & 0x80000000))
+                continue;
+
+            verify_title_t *title = &titles[i++];
+            snprintf(title->name, VERIFY_NAME_SIZE, "%s", dir_entry->name);
+            int ret;
+            if(mcp_handle > 0){
+                snprintf(path, VERIFY_PATH_SIZE, "%s/%s", directory, dir_entry->name);
+                ret = MCP_InstallGetInfo(mcp_handle, path);
+                if(ret){
+                    set_result(title, VERIFY_NOT_INSTALLABLE, ret);
+                    continue;
+                }
+            }
+            snprintf(path, VERIFY_PATH_SIZE, "%s/%s/title.tmd", directory, dir_entry->name);
+            ret = read_tmd_info(fsaHandle, path, &title->title_id, &title->tmd_size);
+            if(!ret && title->tmd_size > TMD_MAX_SIZE)
+                ret = -1;
+            if(ret){
+                set_result(title, VERIFY_NO_SOURCE_TMD, ret);
+                log_printf(fsaHandle, logHandle, "Verify %s: can't read title.tmd: %X\n", title->name, ret);
+            }
+        }
+        count = i;
+        FSA_CloseDir(fsaHandle, dir);
+    }
+    if(mcp_handle > 0)
+        iosClose(mcp_handle);
+
+    if(count <= 0 && titles){
+        iosFree(0x00001, titles);
+        titles = NULL;
+    }
+
+    iosFree(0x00001, path);
+    iosFree(0x00001, dir_entry);
+    *out_titles = titles;
+    return count;
+}
+
+int verify_all_titles(int fsaHandle, const char *directory, int logHandle, bool read_back, int num_workers, u32 buffer_size){
+    verify_title_t *titles = NULL;
+    int count = load_manifest(fsaHandle, directory, logHandle, &titles);
+    log_printf(fsaHandle, logHandle, "Verify: %d titles in %s\n", count, directory);
+    if(count <= 0)
+        return count < 0 ? count : 0;
+
+    if(num_workers < 1)
+        num_workers = 1;
+    // config_load already clamps this, just don't trust callers
+    if(num_workers > VERIFY_MAX_WORKERS)
+        num_workers = VERIFY_MAX_WORKERS;
+    if(num_workers > count)
+        num_workers = count;
+
+    verify_worker_t *workers = iosAlloc(0x00001, num_workers * sizeof(verify_worker_t));
+    if(!workers){
+        debug_printf("Verify: worker alloc failed\n");
+        iosFree(0x00001, titles);
+        return -1;
+    }
+    memset(workers, 0, num_workers * sizeof(verify_worker_t));
+
+    int allocated = 0;
+    for(; allocated < num_workers; allocated++){
+        if(!alloc_worker(&workers[allocated], fsaHandle, buffer_size))
+            break;
+    }
+    if(!allocated){
+        debug_printf("Verify: failed to allocate worker\n");
+        log_printf(fsaHandle, logHandle, "Verify: failed to allocate worker\n");
+        iosFree(0x00001, workers);
+        iosFree(0x00001, titles);
+        return -1;
+    }
+    num_workers = allocated;
+
+    // Create all threads before starting any, so the titles can be split between the ones we got
+    int created = 0;
+    for(int i = 0; i < num_workers; i++){
+        verify_worker_t *worker = &workers[i];
+        worker->threadhand = -1;
+        worker->stack = iosAllocAligned(0x0001, VERIFY_STACK_SIZE, 0x20);
+        if(worker->stack)
+            worker->threadhand = iosCreateThread(verify_worker, worker, (u32*)(worker->stack + VERIFY_STACK_SIZE), VERIFY_STACK_SIZE, 0x78, 0);
+        if(worker->threadhand < 0){
+            debug_printf("Verify: failed to create worker %d: %X\n", i, worker->threadhand);
+            continue;
+        }
+        worker->first = created++;
+    }
+    if(!created){
+        log_printf(fsaHandle, logHandle, "Verify: failed to create worker threads\n");
+        for(int i = 0; i < num_workers; i++)
+            free_worker(&workers[i], fsaHandle);
+        iosFree(0x00001, workers);
+        iosFree(0x00001, titles);
+        return -1;
+    }
+    debug_printf("Verify: %d workers, %lu byte reads\n", created, buffer_size);
+
+    u32 start = timer_ticks();
+
+    for(int i = 0; i < num_workers; i++){
+        verify_worker_t *worker = &workers[i];
+        if(worker->threadhand < 0)
+            continue;
+        worker->directory = directory;
+        worker->titles = titles;
+        worker->count = count;
+        worker->stride = created;
+        worker->read_back = read_back;
+
+        int ret = iosStartThread(worker->threadhand);
+        if(ret < 0){
+            debug_printf("Verify: failed to start worker %d: %X\n", i, ret);
+            // reap it so its stack can be freed, its share of the titles stays unchecked
+            if(iosCancelThread(worker->threadhand, 0) >= 0)
+                iosJoinThread(worker->threadhand, NULL);
+            worker->threadhand = -1;
+            for(int j = worker->first; j < count; j += worker->stride)
+                set_result(&titles[j], VERIFY_NOT_CHECKED, ret);
+        }
+    }
+
+    // the stacks may only be freed once the threads are really gone
+    for(int i = 0; i < num_workers; i++){
+        if(workers[i].threadhand >= 0)
+            iosJoinThread(workers[i].threadhand, NULL);
+    }
+
+    u32 ms = timer_elapsed_ms(start);
+
+    for(int i = 0; i < num_workers; i++)
+        free_worker(&workers[i], fsaHandle);
+    iosFree(0x00001, workers);
+
+    int failed = 0, skipped = 0, mismatches = 0;
+    u64 total_bytes = 0;
+    u32 total_files = 0;
+    for(int i = 0; i < count; i++){
+        verify_title_t *title = &titles[i];
+        total_bytes += title->bytes;
+        total_files += title->files;
+        if(title->result == VERIFY_TMD_MISMATCH || title->result == VERIFY_SIZE_MISMATCH)
+            mismatches++;
+        if(title->result >= VERIFY_MISSING_DIR)
+            failed++;
+        else if(title->result != VERIFY_OK)
+            skipped++;
+        if(read_back)
+            log_printf(fsaHandle, logHandle, "Verify %08lx-%08lx %s: %s (%X), %lu files, %llu bytes, %lu ms\n",
+                    (uint32_t)(title->title_id >> 32), (uint32_t)(title->title_id & 0xFFFFFFFFU), title->name,
+                    verify_result_names[title->result], title->error, title->files, title->bytes, title->ms);
+        else
+            log_printf(fsaHandle, logHandle, "Verify %08lx-%08lx %s: %s (%X), %lu ms\n",
+                    (uint32_t)(title->title_id >> 32), (uint32_t)(title->title_id & 0xFFFFFFFFU), title->name,
+                    verify_result_names[title->result], title->error, title->ms);
+    }
+
+    debug_printf("Verify: %d/%d OK, %d failed, %d skipped in %lu ms\n",
+            count - failed - skipped, count, failed, skipped, ms);
+    log_printf(fsaHandle, logHandle, "Verify: %d/%d OK, %d failed (%d mismatches), %d skipped in %lu ms\n",
+            count - failed - skipped, count, failed, mismatches, skipped, ms);
+    // without read-back only TMDs were read, a byte count or MB/s would mean nothing
+    if(read_back){
+        u32 kbs = throughput_kbs(total_bytes, ms);
+        debug_printf("Verify: read back %lu files, %llu bytes, %lu.%02lu MB/s\n",
+                total_files, total_bytes, kbs / 1024, (kbs % 1024) * 100 / 1024);
+        log_printf(fsaHandle, logHandle, "Verify: read back %lu files, %llu bytes, %lu.%02lu MB/s\n",
+                total_files, total_bytes, kbs / 1024, (kbs % 1024) * 100 / 1024);
+    }
+    update_error_state(skipped, 1);
+
+    iosFree(0x00001, titles);
+    return failed;
+}
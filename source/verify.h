@@ -0,0 +1,16 @@
+#ifndef VERIFY_H
+#define VERIFY_H
+
+#include <wafel/types.h>
+
+#define VERIFY_MAX_WORKERS 8
+
+// Reads the title id and signed size out of a title.tmd
+int read_tmd_info(int fsaHandle, const char *path, u64 *title_id, u32 *tmd_size);
+
+// Checks every installable title in directory got installed to the MLC, optionally reading it back.
+// Returns the number of installed titles that failed verification, or < 0 if it couldn't run.
+// Titles that couldn't be checked only raise a warning.
+int verify_all_titles(int fsaHandle, const char *directory, int logHandle, bool read_back, int num_workers, u32 buffer_size);
+
+#endif